@@ -1,6 +1,7 @@
 #ifndef SMALLISP_BUILTIN_HPP
 #define SMALLISP_BUILTIN_HPP
 #include "eval.hpp"
+#include "scheduler.hpp"
 #include <iostream>
 
 namespace sml
@@ -8,20 +9,32 @@ namespace sml
 
 inline object_t builtin_car(const object_t& cons, env_t& env)
 {
+    // (car expr): car of the list that expr evaluates to
     if(not cons.is_cell())
     {
         return object_t(nil);
     }
-    return eval(car(std::get<cell_t>(cons.data)), env);
+    const object_t list = eval(car(cons), env);
+    if(not list.is_cell())
+    {
+        return object_t(nil);
+    }
+    return car(list);
 }
 
 inline object_t builtin_cdr(const object_t& cons, env_t& env)
 {
+    // (cdr expr): cdr of the list that expr evaluates to
     if(not cons.is_cell())
     {
         return object_t(nil);
     }
-    return eval(cdr(std::get<cell_t>(cons.data)), env);
+    const object_t list = eval(car(cons), env);
+    if(not list.is_cell())
+    {
+        return object_t(nil);
+    }
+    return cdr(list);
 }
 
 inline object_t builtin_eq(const object_t& cons, env_t& env)
@@ -89,7 +102,7 @@ struct builtin_plus_impl
 inline object_t builtin_plus(const object_t& cons, env_t& env)
 {
     auto list = make_list(std::get<cell_t>(cons.data));
-    object_t retval(list.front());
+    object_t retval(eval(list.front(), env));
     list.erase(list.begin());
     for(const auto& obj : list)
     {
@@ -97,6 +110,10 @@ inline object_t builtin_plus(const object_t& cons, env_t& env)
         retval = std::visit(builtin_plus_impl(),
                             retval.data, evaled.data);
     }
+    if(env.rt && retval.is_string())
+    {
+        charge_heap(*env.rt, env, std::get<std::string>(retval.data).capacity());
+    }
     return retval;
 }
 
@@ -211,5 +228,216 @@ inline object_t builtin_define(const object_t& cons, env_t& env)
     return env.at(fn.name);
 }
 
+inline object_t builtin_stats(const object_t&, env_t& env)
+{
+    // (stats) -> ((cells . n) (cell-bytes . n) ...)
+    if(not env.rt)
+    {
+        return object_t(nil);
+    }
+    update_heap(*env.rt, env);
+    const stats_t& stats = env.rt->stats;
+
+    const std::pair<const char*, std::uint64_t> entries[] = {
+        {"cells",        stats.heap.cells},
+        {"cell-bytes",   stats.heap.cell_bytes},
+        {"strings",      stats.heap.strings},
+        {"string-bytes", stats.heap.string_bytes},
+        {"funcs",        stats.heap.funcs},
+        {"func-bytes",   stats.heap.func_bytes},
+        {"heap-bytes",   stats.heap.bytes()},
+        {"peak-bytes",   stats.peak_bytes},
+        {"evals",        stats.evals},
+        {"applies",      stats.applies},
+        {"max-depth",    stats.max_depth},
+    };
+
+    object_t list(nil);
+    object_t* cons = std::addressof(list);
+    for(const auto& entry : entries)
+    {
+        cell_t kv;
+        car(kv) = object_t(symbol_t(entry.first));
+        cdr(kv) = object_t(static_cast<std::int64_t>(entry.second));
+
+        *cons = cell_t{};
+        car(*cons) = object_t(std::move(kv));
+        cons = std::addressof(cdr(*cons));
+    }
+    return list;
+}
+
+inline object_t builtin_spawn(const object_t& cons, env_t& env)
+{
+    // (spawn fn args...) calls (fn args...) in a new task. returns nil.
+    const object_t fn = eval(car(cons), env);
+    if(not fn.is_func())
+    {
+        throw std::runtime_error("[error] (spawn <func> <args...>)");
+    }
+    std::vector<object_t> args;
+    if(cdr(cons).is_cell())
+    {
+        for(auto&& arg : make_list(std::get<cell_t>(cdr(cons).data)))
+        {
+            args.push_back(eval(arg, env));
+        }
+    }
+    if(args.size() != std::get<func_t>(fn.data).args.size())
+    {
+        throw std::runtime_error("[error] lacking function arguments");
+    }
+
+    // the task outlives the local frames of the caller, so the bindings in
+    // them are copied. the root env is shared.
+    env_t frame;
+    frame.rt     = env.rt;
+    frame.parent = std::addressof(env.root());
+    for(const env_t* f = std::addressof(env); f != frame.parent; f = f->parent)
+    {
+        frame.objs.insert(f->objs.begin(), f->objs.end()); // inner ones win
+    }
+
+    scheduler_of(env).spawn([fn, args = std::move(args), env = std::move(frame)]() mutable {
+        const func_t& f = std::get<func_t>(fn.data);
+        if(env.rt) {env.rt->stats.applies += 1;}
+        for(std::size_t i=0; i<args.size(); ++i)
+        {
+            env[f.args.at(i)] = std::move(args.at(i));
+        }
+        eval(f.body, env);
+    });
+    return object_t(nil);
+}
+
+inline channel_t& get_channel(const object_t& obj)
+{
+    if(not obj.is_chan())
+    {
+        throw std::runtime_error("[error] type error: expected a channel");
+    }
+    return *std::get<chan_t>(obj.data).ch;
+}
+
+inline object_t builtin_chan(const object_t& cons, env_t& env)
+{
+    // (chan) or (chan capacity)
+    std::int64_t capacity = 1;
+    if(cons.is_cell())
+    {
+        const auto cap = eval(car(cons), env);
+        if(not cap.is_int())
+        {
+            throw std::runtime_error("[error] (chan <capacity>)");
+        }
+        capacity = std::get<std::int64_t>(cap.data);
+    }
+    scheduler_of(env);
+    return object_t(chan_t(std::make_shared<channel_t>(
+                static_cast<std::size_t>(std::max<std::int64_t>(capacity, 1)))));
+}
+
+inline object_t builtin_send(const object_t& cons, env_t& env)
+{
+    // (send ch expr) blocks while ch is full. returns the object sent.
+    const object_t chan = eval(car(cons), env);
+    object_t value      = eval(car(cdr(cons)), env);
+
+    channel_t&   ch    = get_channel(chan);
+    scheduler_t& sched = scheduler_of(env);
+    while(ch.buffer.size() >= ch.capacity && not ch.closed)
+    {
+        sched.wait(ch.senders);
+    }
+    if(ch.closed)
+    {
+        throw std::runtime_error("[error] send to a closed channel");
+    }
+    ch.buffer.push_back(value);
+    sched.notify(ch.receivers);
+    return value;
+}
+
+inline object_t builtin_recv(const object_t& cons, env_t& env)
+{
+    // (recv ch) blocks while ch is empty. returns nil if ch is closed.
+    const object_t chan = eval(car(cons), env);
+
+    channel_t&   ch    = get_channel(chan);
+    scheduler_t& sched = scheduler_of(env);
+    while(ch.buffer.empty() && not ch.closed)
+    {
+        if(ch.fd >= 0 && sched.poll_port(ch))
+        {
+            continue;
+        }
+        try
+        {
+            sched.wait(ch.receivers);
+        }
+        catch(...) // cancelled. the port is no longer waited by anyone
+        {
+            if(ch.receivers.empty()) {sched.disarm(ch);}
+            throw;
+        }
+    }
+    if(ch.buffer.empty())
+    {
+        return object_t(nil);
+    }
+    object_t value = std::move(ch.buffer.front());
+    ch.buffer.pop_front();
+    sched.notify(ch.senders);
+    return value;
+}
+
+inline object_t builtin_close(const object_t& cons, env_t& env)
+{
+    // (close ch) makes blocked recv return nil after the buffer is drained.
+    const object_t chan = eval(car(cons), env);
+
+    channel_t&   ch    = get_channel(chan);
+    scheduler_t& sched = scheduler_of(env);
+    ch.closed = true;
+    if(ch.fd >= 0) // an input port is released here
+    {
+        sched.disarm(ch);
+        ::close(ch.fd);
+        ch.fd = -1;
+    }
+    sched.notify_all(ch.receivers);
+    sched.notify_all(ch.senders);
+    return object_t(nil);
+}
+
+inline object_t builtin_open_input(const object_t& cons, env_t& env)
+{
+    // (open-input "path") returns a channel that receives lines of the file.
+    const object_t path = eval(car(cons), env);
+    if(not path.is_string())
+    {
+        throw std::runtime_error("[error] (open-input \"<path>\")");
+    }
+    const std::string& name = std::get<std::string>(path.data);
+
+    // a fifo opened with O_NONBLOCK reads EOF until a writer opens it,
+    // so it waits for the writer here and becomes non-blocking after that.
+    auto ch = std::make_shared<channel_t>(1);
+    ch->fd = ::open(name.c_str(), O_RDONLY | O_CLOEXEC);
+    if(ch->fd < 0)
+    {
+        throw std::runtime_error("[error] couldn't open " + name);
+    }
+    struct stat st;
+    ch->pollable = (::fstat(ch->fd, std::addressof(st)) == 0) && not S_ISREG(st.st_mode);
+    if(ch->pollable)
+    {
+        ::fcntl(ch->fd, F_SETFL, ::fcntl(ch->fd, F_GETFL) | O_NONBLOCK);
+    }
+
+    scheduler_of(env);
+    return object_t(chan_t(std::move(ch)));
+}
+
 } // sml
 #endif// SMALLISP_BUILTIN_HPP
@@ -1,7 +1,9 @@
 #ifndef SMALLISP_EVAL_HPP
 #define SMALLISP_EVAL_HPP
 #include "object.hpp"
+#include "runtime.hpp"
 #include <variant>
+#include <stdexcept>
 
 namespace sml
 {
@@ -21,23 +23,34 @@ inline std::vector<object_t> make_list(const cell_t& cell)
     return vec;
 }
 
-object_t eval(const object_t& obj, env_t& env);
+inline object_t eval(const object_t& obj, env_t& env);
 
-object_t apply(const func_t& fn, const object_t& args, env_t& env)
+inline object_t apply(const func_t& fn, const object_t& args, env_t& env)
 {
+    if(env.rt) {env.rt->stats.applies += 1;}
+
     const auto arguments = make_list(std::get<cell_t>(args.data));
     if(arguments.size() != fn.args.size())
     {
         throw std::runtime_error("[error] lacking function arguments");
     }
 
-    env_t tmp_env = env;
+    // a local frame. `let` or `define` in the callee binds in it. the caller's
+    // local bindings are copied so that its parent is always the root and a
+    // lookup doesn't walk the frames of all the callers.
+    env_t local;
+    local.rt     = env.rt;
+    local.parent = std::addressof(env.root());
+    for(const env_t* f = std::addressof(env); f != local.parent; f = f->parent)
+    {
+        local.objs.insert(f->objs.begin(), f->objs.end()); // inner ones win
+    }
     for(std::size_t i=0; i<fn.args.size(); ++i)
     {
-        tmp_env[fn.args.at(i)] = eval(arguments.at(i), env);
+        local[fn.args.at(i)] = eval(arguments.at(i), env);
     }
 
-    return eval(fn.body, tmp_env);
+    return eval(fn.body, local);
 }
 
 struct evaluator
@@ -56,13 +69,15 @@ struct evaluator
     object_t operator()(const std::string& v)  {return object_t(v);}
     object_t operator()(const builtin_t& v)    {return object_t(v);}
     object_t operator()(const func_t& v)       {return object_t(v);}
+    object_t operator()(const chan_t& v)       {return object_t(v);}
     object_t operator()(const symbol_t& symbol)
     {
-        if(env.get().objs.count(symbol) == 0)
+        const object_t* found = env.get().find(symbol);
+        if(found == nullptr)
         {
             return object_t(nil);
         }
-        return env.get().objs.at(symbol);
+        return *found;
     }
     object_t operator()(const cell_t& c)
     {
@@ -82,10 +97,24 @@ struct evaluator
     std::reference_wrapper<env_t> env;
 };
 
-object_t eval(const object_t& obj, env_t& env)
+inline object_t eval(const object_t& obj, env_t& env)
 {
+    eval_guard guard(env.rt.get(), env);
     return std::visit(evaluator(env), obj.data);
 }
 
+// evaluates an expression at the top level, like a form in a script.
+inline object_t eval_toplevel(const object_t& obj, env_t& env)
+{
+    if(not env.rt)
+    {
+        return eval(obj, env);
+    }
+    begin_toplevel(*env.rt);
+    object_t retval = eval(obj, env);
+    end_toplevel(*env.rt, env);
+    return retval;
+}
+
 } // sml
 #endif // SMALLISP_EVAL_HPP
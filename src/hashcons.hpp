@@ -0,0 +1,164 @@
+#ifndef SMALLISP_HASHCONS_HPP
+#define SMALLISP_HASHCONS_HPP
+#include "object.hpp"
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <unordered_map>
+#include <vector>
+
+namespace sml
+{
+
+inline std::size_t hash_combine(std::size_t seed, std::size_t h) noexcept
+{
+    return seed ^ (h + 0x9e3779b97f4a7c15ull + (seed << 6) + (seed >> 2));
+}
+
+struct hash_visitor
+{
+    std::size_t operator()(const nil_t&)          const noexcept {return 0x6e696c;}
+    std::size_t operator()(const true_t&)         const noexcept {return 0x54;}
+    std::size_t operator()(const std::int64_t& v) const noexcept {return std::hash<std::int64_t>{}(v);}
+    std::size_t operator()(const std::string& v)  const noexcept {return std::hash<std::string>{}(v);}
+    std::size_t operator()(const symbol_t& v)     const noexcept {return hash_combine(0x73, std::hash<std::string>{}(v.name));}
+    std::size_t operator()(const func_t& v)       const noexcept {return hash_combine(0x66, std::hash<std::string>{}(v.name));}
+    std::size_t operator()(const builtin_t& v)    const noexcept {return hash_combine(0x62, std::hash<std::string>{}(v.name));}
+    std::size_t operator()(const chan_t& v)       const noexcept {return std::hash<std::shared_ptr<channel_t>>{}(v.ch);}
+    std::size_t operator()(const cell_t& v)       const noexcept;
+};
+
+// structural hash that is consistent with operator==. O(1) for interned cells.
+inline std::size_t hash_value(const object_t& obj) noexcept
+{
+    return std::visit(hash_visitor{}, obj.data);
+}
+
+inline std::size_t hash_cell(const object_t& lhs, const object_t& rhs) noexcept
+{
+    const std::size_t h = hash_combine(hash_combine(0x63, hash_value(lhs)), hash_value(rhs));
+    return h == 0 ? 1 : h; // 0 means "not cached"
+}
+
+inline std::size_t hash_visitor::operator()(const cell_t& v) const noexcept
+{
+    if(v.node->hash != 0)
+    {
+        return v.node->hash;
+    }
+    // walk along the spine to avoid recursion on long lists
+    std::vector<const cell_node_t*> spine;
+    const cell_node_t* node = v.node.get();
+    while(true)
+    {
+        spine.push_back(node);
+        const auto* tail = std::get_if<cell_t>(std::addressof(node->objs.back().data));
+        if(not tail || tail->node->hash != 0) {break;}
+        node = tail->node.get();
+    }
+    std::size_t h = hash_value(spine.back()->objs.back());
+    for(auto iter = spine.rbegin(); iter != spine.rend(); ++iter)
+    {
+        h = hash_combine(hash_combine(0x63, hash_value((*iter)->objs.front())), h);
+        h = (h == 0) ? 1 : h;
+    }
+    return h;
+}
+
+// weak intern table of cons cells. structurally equal lists interned by the
+// same table share one node, and equality between them is a pointer check.
+// the table does not keep nodes alive; entries of released nodes are swept.
+class cell_table
+{
+  public:
+
+    cell_table(): id_(next_id()) {}
+    ~cell_table() = default;
+
+    cell_table(cell_table const&) = delete;
+    cell_table(cell_table&&)      = default;
+    cell_table& operator=(cell_table const&) = delete;
+    cell_table& operator=(cell_table&&)      = default;
+
+    // returns an interned object structurally equal to `obj`.
+    object_t intern(const object_t& obj)
+    {
+        const auto* cell = std::get_if<cell_t>(std::addressof(obj.data));
+        if(not cell || cell->node->table == id_)
+        {
+            return obj;
+        }
+        std::vector<const cell_node_t*> spine;
+        const cell_node_t* node = cell->node.get();
+        while(true)
+        {
+            spine.push_back(node);
+            const auto* tail = std::get_if<cell_t>(std::addressof(node->objs.back().data));
+            if(not tail || tail->node->table == id_) {break;}
+            node = tail->node.get();
+        }
+        object_t list = spine.back()->objs.back();
+        for(auto iter = spine.rbegin(); iter != spine.rend(); ++iter)
+        {
+            list = object_t(this->cons(this->intern((*iter)->objs.front()), std::move(list)));
+        }
+        return list;
+    }
+
+    // `lhs` and `rhs` must already be interned by this table.
+    cell_t cons(object_t lhs, object_t rhs)
+    {
+        const std::size_t h = hash_cell(lhs, rhs);
+        const auto range = table_.equal_range(h);
+        for(auto iter = range.first; iter != range.second; ++iter)
+        {
+            auto node = iter->second.lock();
+            if(node && node->objs.front() == lhs && node->objs.back() == rhs)
+            {
+                cell_t found;
+                found.node = std::move(node);
+                return found;
+            }
+        }
+        if(table_.size() >= sweep_at_)
+        {
+            this->sweep();
+        }
+        cell_t cell;
+        cell.node->objs.front() = std::move(lhs);
+        cell.node->objs.back()  = std::move(rhs);
+        cell.node->hash  = h;
+        cell.node->table = id_;
+        table_.emplace(h, cell.node);
+        return cell;
+    }
+
+    std::size_t size() const noexcept {return table_.size();}
+
+    // removes entries of the nodes already released.
+    void sweep()
+    {
+        for(auto iter = table_.begin(); iter != table_.end();)
+        {
+            if(iter->second.expired()) {iter = table_.erase(iter);} else {++iter;}
+        }
+        sweep_at_ = std::max<std::size_t>(1024, table_.size() * 2);
+    }
+
+  private:
+
+    static std::uint64_t next_id() noexcept
+    {
+        static std::atomic<std::uint64_t> id{0};
+        return ++id;
+    }
+
+  private:
+
+    std::uint64_t id_;
+    std::size_t   sweep_at_ = 1024;
+    std::unordered_multimap<std::size_t, std::weak_ptr<cell_node_t>> table_;
+};
+
+} // sml
+#endif // SMALLISP_HASHCONS_HPP
@@ -0,0 +1,213 @@
+#ifndef SMALLISP_INTERPRETER_HPP
+#define SMALLISP_INTERPRETER_HPP
+#include "object.hpp"
+#include "eval.hpp"
+#include "parser.hpp"
+#include <initializer_list>
+#include <iterator>
+#include <memory>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+namespace sml
+{
+
+// an expression that is parsed once and evaluated many times.
+// parameters are bound to the slots in its own frame, whose parent is the
+// env of the interpreter that prepared it, so it must not outlive the
+// interpreter. copies share the frame.
+struct prepared_t
+{
+    prepared_t()  = default;
+    ~prepared_t() = default;
+    prepared_t(prepared_t const&) = default;
+    prepared_t(prepared_t&&)      = default;
+    prepared_t& operator=(prepared_t const&) = default;
+    prepared_t& operator=(prepared_t&&)      = default;
+
+    std::vector<object_t>  exprs;
+    std::shared_ptr<env_t> frame;  // parameters don't overwrite globals
+    std::vector<object_t*> params; // points std::map nodes; they never move
+    object_t               result;
+};
+
+// overwrite `slot` with the value of a host object. if the slot already has
+// a value of the same type, its storage is reused.
+inline void assign(object_t& slot, bool v)
+{
+    if(v) {slot = object_t(true_t{});} else {slot = object_t(nil);}
+}
+template<typename T, std::enable_if_t<std::is_integral_v<T>, std::nullptr_t> = nullptr>
+void assign(object_t& slot, T v)
+{
+    slot.data.template emplace<std::int64_t>(static_cast<std::int64_t>(v));
+}
+inline void assign(object_t& slot, std::string_view v)
+{
+    if(slot.is_string())
+    {
+        std::get<std::string>(slot.data).assign(v.data(), v.size());
+        return;
+    }
+    slot = object_t(std::string(v));
+}
+inline void assign(object_t& slot, const char* v)
+{
+    assign(slot, std::string_view(v));
+}
+inline void assign(object_t& slot, const std::string& v)
+{
+    assign(slot, std::string_view(v));
+}
+
+// integer sequence -> list. cons cells already in the slot are reused.
+template<typename Iterator>
+void assign(object_t& slot, Iterator first, Iterator last)
+{
+    object_t* cons = std::addressof(slot);
+    for(; first != last; ++first)
+    {
+        if(not cons->is_cell())
+        {
+            *cons = cell_t{};
+        }
+        assign(car(*cons), *first);
+        cons = std::addressof(cdr(*cons));
+    }
+    *cons = object_t(nil);
+    return;
+}
+template<typename Range, typename = decltype(std::begin(std::declval<const Range&>())),
+         std::enable_if_t<std::is_integral_v<typename std::iterator_traits<
+             decltype(std::begin(std::declval<const Range&>()))>::value_type>,
+         std::nullptr_t> = nullptr>
+void assign(object_t& slot, const Range& range)
+{
+    assign(slot, std::begin(range), std::end(range));
+}
+
+class interpreter
+{
+  public:
+
+    interpreter(): env_(std::make_unique<env_t>(init_env())) {}
+    explicit interpreter(env_t env): env_(std::make_unique<env_t>(std::move(env)))
+    {
+        if(not env_->rt)
+        {
+            env_->rt = std::make_shared<runtime_t>();
+        }
+    }
+    ~interpreter()
+    {
+        // unwind tasks left blocked. they refer the env and the runtime
+        if(env_ && env_->rt && env_->rt->scheduler)
+        {
+            env_->rt->scheduler->cancel();
+        }
+    }
+
+    interpreter(interpreter const&) = delete;
+    interpreter(interpreter&&)      = default;
+    interpreter& operator=(interpreter const&) = delete;
+    interpreter& operator=(interpreter&&)      = default;
+
+    // parse and evaluate all the expressions in `src`. returns the last value.
+    object_t eval(std::string_view src)
+    {
+        object_t retval(nil);
+        for(const auto& expr : this->read(src))
+        {
+            retval = eval_toplevel(expr, *env_);
+        }
+        return retval;
+    }
+
+    // parse `src` once. the symbols in `params` are bound to the arguments
+    // passed to `eval(prepared, args...)` in this order.
+    prepared_t prepare(std::string_view src,
+                       std::initializer_list<std::string_view> params = {})
+    {
+        prepared_t p;
+        p.exprs = this->read(src);
+        p.frame = std::make_shared<env_t>();
+        p.frame->rt     = env_->rt;
+        p.frame->parent = env_.get();
+        for(const auto& param : params)
+        {
+            p.params.push_back(std::addressof((*p.frame)[param]));
+        }
+        return p;
+    }
+
+    // binds `args` and evaluates the prepared expressions. the returned
+    // reference is valid until the next evaluation of `p`.
+    template<typename ... Ts>
+    object_t const& eval(prepared_t& p, Ts&& ... args)
+    {
+        if(sizeof...(Ts) != p.params.size())
+        {
+            throw std::runtime_error("[error] number of arguments of "
+                    "prepared expression does not match");
+        }
+        [[maybe_unused]] std::size_t idx = 0;
+        (assign(*p.params[idx++], std::forward<Ts>(args)), ...);
+
+        env_t& frame = p.frame ? *p.frame : *env_;
+        for(const auto& expr : p.exprs)
+        {
+            p.result = eval_toplevel(expr, frame);
+        }
+        return p.result;
+    }
+
+    // if enabled, lists read after this are hash-consed so that the same
+    // structure shares memory and `=` between them becomes a pointer check.
+    void hashcons(bool enable)
+    {
+        if(enable && not env_->rt->cells)
+        {
+            env_->rt->cells = std::make_shared<cell_table>();
+        }
+        else if(not enable)
+        {
+            env_->rt->cells.reset();
+        }
+        return;
+    }
+    bool hashcons() const noexcept {return static_cast<bool>(env_->rt->cells);}
+
+    // e.g. `b.runtime().modules = a.runtime().modules;` shares parsed modules.
+    runtime_t&       runtime()       noexcept {return *env_->rt;}
+    runtime_t const& runtime() const noexcept {return *env_->rt;}
+
+    limits_t&       limits()       noexcept {return env_->rt->limits;}
+    limits_t const& limits() const noexcept {return env_->rt->limits;}
+
+    // counters are updated while evaluating; heap usage is measured here.
+    stats_t const& stats()
+    {
+        update_heap(*env_->rt, *env_);
+        return env_->rt->stats;
+    }
+
+    env_t&       env()       noexcept {return *env_;}
+    env_t const& env() const noexcept {return *env_;}
+
+  private:
+
+    std::vector<object_t> read(std::string_view src)
+    {
+        auto exprs = read_exprs(src);
+        intern_exprs(*env_->rt, exprs);
+        return exprs;
+    }
+
+  private:
+
+    std::unique_ptr<env_t> env_; // tasks refer it, so it must not move
+};
+
+} // sml
+#endif // SMALLISP_INTERPRETER_HPP
@@ -1,26 +1,156 @@
 #include "eval.hpp"
 #include "parser.hpp"
 #include <iostream>
+#include <limits>
+#include <optional>
+#include <string_view>
 
-int main(int argc, char **argv)
+// evaluates expressions one by one as they arrive, e.g. from a pipe. each
+// expression and its result are released before reading the next. an error
+// in an expression is reported and the stream continues.
+int stream(std::istream& is, sml::env_t& env)
 {
-    if(argc != 2)
+    int status = 0;
+    while(true)
     {
-        std::cerr << "[error]: usage ./smallisp [script]" << std::endl;
-        return 1;
+        std::optional<sml::object_t> expr;
+        try
+        {
+            expr = sml::try_read_expr(is);
+            if(expr && env.rt->cells)
+            {
+                *expr = env.rt->cells->intern(*expr);
+            }
+        }
+        catch(const sml::parse_error& err)
+        {
+            std::cerr << err.what() << std::endl;
+            status = 1;
+            // skip the rest of the broken expression to recover
+            is.clear();
+            sml::skip_lists(is, err.depth);
+            continue;
+        }
+        catch(const std::exception& err)
+        {
+            std::cerr << err.what() << std::endl;
+            status = 1;
+            // skip the rest of the line to recover
+            is.clear();
+            is.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+            continue;
+        }
+        if(not expr) // EOF
+        {
+            break;
+        }
+        try
+        {
+            std::cerr << sml::eval_toplevel(*expr, env) << std::endl;
+            if(env.rt->scheduler) // let the tasks spawned run until they block
+            {
+                env.rt->scheduler->run_ready();
+            }
+        }
+        catch(const std::exception& err)
+        {
+            std::cerr << err.what() << std::endl;
+            status = 1;
+        }
     }
+    return status;
+}
+
+int main(int argc, char **argv)
+{
+    const char* usage = "[error]: usage ./smallisp [--stats] [--hashcons] [--max-heap=bytes] "
+                        "[--max-steps=n] [--max-depth=n] [script|-]";
 
     sml::env_t env = sml::init_env();
+    bool show_stats = false;
+    const char* script = nullptr;
+    for(int i=1; i<argc; ++i)
+    {
+        const std::string_view arg(argv[i]);
+        const auto value = [&arg]() {
+            return std::stoull(std::string(arg.substr(arg.find('=') + 1)));
+        };
+        try
+        {
+            if(arg == "--stats")
+            {
+                show_stats = true;
+                env.rt->track_heap = true;
+            }
+            else if(arg == "--hashcons")
+            {
+                env.rt->cells = std::make_shared<sml::cell_table>();
+            }
+            else if(arg.substr(0, 11) == "--max-heap=")
+            {
+                env.rt->limits.max_heap_bytes = value();
+            }
+            else if(arg.substr(0, 12) == "--max-steps=")
+            {
+                env.rt->limits.max_eval_steps = value();
+            }
+            else if(arg.substr(0, 12) == "--max-depth=")
+            {
+                env.rt->limits.max_depth = value();
+            }
+            else if(script == nullptr && arg.substr(0, 2) != "--")
+            {
+                script = argv[i];
+            }
+            else
+            {
+                throw std::invalid_argument(argv[i]);
+            }
+        }
+        catch(const std::logic_error&) // invalid_argument, out_of_range
+        {
+            std::cerr << usage << std::endl;
+            return 1;
+        }
+    }
 
-    std::ifstream ifs(argv[1]);
-    while(true)
+    int status = 0;
+    try
     {
-        sml::object_t expr = sml::read_expr(ifs);
-        if(expr.is_nil())
+        if(script == nullptr || std::string_view(script) == "-")
         {
-            break;
+            status = stream(std::cin, env);
         }
-        std::cerr << sml::eval(expr, env) << std::endl;
+        else
+        {
+            env.rt->module_dir = std::filesystem::path(script).parent_path();
+            sml::parsed_t parsed =
+                sml::read_exprs_parallel(sml::read_file(script));
+            sml::intern_exprs(*env.rt, parsed.exprs);
+            for(const auto& expr : parsed.exprs)
+            {
+                std::cerr << sml::eval_toplevel(expr, env) << std::endl;
+            }
+            if(parsed.error)
+            {
+                std::rethrow_exception(parsed.error);
+            }
+        }
+        if(env.rt->scheduler) // wait for the tasks spawned
+        {
+            env.rt->scheduler->run();
+        }
+    }
+    catch(const std::exception& err)
+    {
+        std::cerr << err.what() << std::endl;
+        status = 1;
+    }
+
+    if(show_stats)
+    {
+        sml::update_heap(*env.rt, env);
+        std::cerr << env.rt->stats << std::endl;
     }
-    return 0;
+    return status;
 }
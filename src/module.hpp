@@ -0,0 +1,76 @@
+#ifndef SMALLISP_MODULE_HPP
+#define SMALLISP_MODULE_HPP
+#include "object.hpp"
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace sml
+{
+
+// parsed expressions of a file.
+struct module_t
+{
+    module_t()  = default;
+    ~module_t() = default;
+    module_t(module_t const&) = default;
+    module_t(module_t&&)      = default;
+    module_t& operator=(module_t const&) = default;
+    module_t& operator=(module_t&&)      = default;
+
+    std::filesystem::path            path;
+    std::filesystem::file_time_type  mtime;
+    std::vector<object_t>            exprs;
+};
+
+// parsed modules keyed by path and mtime. it can be shared by interpreters,
+// even in different threads, so that a library is parsed only once.
+class module_cache
+{
+  public:
+
+    module_cache()  = default;
+    ~module_cache() = default;
+    module_cache(module_cache const&) = delete;
+    module_cache(module_cache&&)      = delete;
+    module_cache& operator=(module_cache const&) = delete;
+    module_cache& operator=(module_cache&&)      = delete;
+
+    // returns nullptr if the file is not cached or modified after cached.
+    std::shared_ptr<const module_t>
+    find(const std::filesystem::path& path, std::filesystem::file_time_type mtime) const
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        const auto found = modules_.find(path);
+        if(found == modules_.end() || found->second->mtime != mtime)
+        {
+            return nullptr;
+        }
+        return found->second;
+    }
+
+    std::shared_ptr<const module_t> insert(module_t mod)
+    {
+        auto ptr = std::make_shared<const module_t>(std::move(mod));
+        std::lock_guard<std::mutex> lock(mtx_);
+        modules_[ptr->path] = ptr;
+        return ptr;
+    }
+
+    std::size_t size() const
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        return modules_.size();
+    }
+
+  private:
+
+    mutable std::mutex mtx_;
+    std::map<std::filesystem::path, std::shared_ptr<const module_t>> modules_;
+};
+
+} // sml
+#endif // SMALLISP_MODULE_HPP
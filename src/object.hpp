@@ -1,5 +1,8 @@
 #ifndef SMALLISP_OBJECT_HPP
 #define SMALLISP_OBJECT_HPP
+#include <array>
+#include <cstdint>
+#include <memory>
 #include <utility>
 #include <variant>
 #include <vector>
@@ -14,6 +17,8 @@ namespace sml
 // forward decl
 struct object_t;
 struct env_t;
+struct runtime_t; // runtime.hpp
+struct channel_t; // scheduler.hpp
 
 template<typename charT, typename traits>
 std::basic_ostream<charT, traits>&
@@ -87,22 +92,26 @@ operator<<(std::basic_ostream<charT, traits>& os, const symbol_t& sym)
     return os;
 }
 
+// a pair of objects. nodes are shared between the copies of a cell and
+// copied when one of them is modified (see `mutate`), so copying a list is O(1).
+struct cell_node_t;
+
 struct cell_t
 {
-    cell_t(): objs(2) {}
+    cell_t();
     ~cell_t() = default;
     cell_t(const cell_t&) = default;
     cell_t(cell_t&&)      = default;
     cell_t& operator=(const cell_t&) = default;
     cell_t& operator=(cell_t&&)      = default;
 
-    std::vector<object_t> objs;
+    std::shared_ptr<cell_node_t> node;
 };
 
-inline object_t const& car(cell_t const& cell) noexcept {return cell.objs.front();}
-inline object_t&       car(cell_t&       cell) noexcept {return cell.objs.front();}
-inline object_t const& cdr(cell_t const& cell) noexcept {return cell.objs.back();}
-inline object_t&       cdr(cell_t&       cell) noexcept {return cell.objs.back();}
+object_t const& car(cell_t const& cell) noexcept;
+object_t&       car(cell_t&       cell);
+object_t const& cdr(cell_t const& cell) noexcept;
+object_t&       cdr(cell_t&       cell);
 
 template<typename charT, typename traits>
 std::basic_ostream<charT, traits>&
@@ -112,12 +121,12 @@ operator<<(std::basic_ostream<charT, traits>& os, const cell_t& cell)
     return os;
 }
 
-inline bool operator==(const cell_t& lhs, const cell_t& rhs) noexcept {return lhs.objs == rhs.objs;}
-inline bool operator!=(const cell_t& lhs, const cell_t& rhs) noexcept {return lhs.objs != rhs.objs;}
-inline bool operator< (const cell_t& lhs, const cell_t& rhs) noexcept {return lhs.objs <  rhs.objs;}
-inline bool operator<=(const cell_t& lhs, const cell_t& rhs) noexcept {return lhs.objs <= rhs.objs;}
-inline bool operator> (const cell_t& lhs, const cell_t& rhs) noexcept {return lhs.objs >  rhs.objs;}
-inline bool operator>=(const cell_t& lhs, const cell_t& rhs) noexcept {return lhs.objs >= rhs.objs;}
+bool operator==(const cell_t& lhs, const cell_t& rhs) noexcept;
+bool operator< (const cell_t& lhs, const cell_t& rhs) noexcept;
+inline bool operator!=(const cell_t& lhs, const cell_t& rhs) noexcept {return !(lhs == rhs);}
+inline bool operator<=(const cell_t& lhs, const cell_t& rhs) noexcept {return !(rhs <  lhs);}
+inline bool operator> (const cell_t& lhs, const cell_t& rhs) noexcept {return   rhs <  lhs; }
+inline bool operator>=(const cell_t& lhs, const cell_t& rhs) noexcept {return !(lhs <  rhs);}
 
 struct builtin_t
 {
@@ -185,6 +194,35 @@ inline bool operator<=(const func_t& lhs, const func_t& rhs) noexcept {return lh
 inline bool operator> (const func_t& lhs, const func_t& rhs) noexcept {return lhs.name >  rhs.name;}
 inline bool operator>=(const func_t& lhs, const func_t& rhs) noexcept {return lhs.name >= rhs.name;}
 
+// a handle of a channel. copies refer the same channel.
+struct chan_t
+{
+    chan_t()  = default;
+    explicit chan_t(std::shared_ptr<channel_t> c): ch(std::move(c)) {}
+    ~chan_t() = default;
+    chan_t(chan_t const&) = default;
+    chan_t(chan_t&&)      = default;
+    chan_t& operator=(chan_t const&) = default;
+    chan_t& operator=(chan_t&&)      = default;
+
+    std::shared_ptr<channel_t> ch;
+};
+
+template<typename charT, typename traits>
+std::basic_ostream<charT, traits>&
+operator<<(std::basic_ostream<charT, traits>& os, const chan_t&)
+{
+    os << "chan";
+    return os;
+}
+
+inline bool operator==(const chan_t& lhs, const chan_t& rhs) noexcept {return lhs.ch == rhs.ch;}
+inline bool operator!=(const chan_t& lhs, const chan_t& rhs) noexcept {return lhs.ch != rhs.ch;}
+inline bool operator< (const chan_t& lhs, const chan_t& rhs) noexcept {return lhs.ch <  rhs.ch;}
+inline bool operator<=(const chan_t& lhs, const chan_t& rhs) noexcept {return lhs.ch <= rhs.ch;}
+inline bool operator> (const chan_t& lhs, const chan_t& rhs) noexcept {return lhs.ch >  rhs.ch;}
+inline bool operator>=(const chan_t& lhs, const chan_t& rhs) noexcept {return lhs.ch >= rhs.ch;}
+
 struct object_t
 {
     object_t() noexcept: data(nil) {}
@@ -202,6 +240,7 @@ struct object_t
     object_t(cell_t       v): data(std::move(v)) {}
     object_t(func_t       v): data(std::move(v)) {}
     object_t(builtin_t    v): data(std::move(v)) {}
+    object_t(chan_t       v): data(std::move(v)) {}
 
     bool is_nil()     const noexcept {return std::holds_alternative<nil_t       >(data);}
     bool is_T()       const noexcept {return std::holds_alternative<true_t      >(data);}
@@ -211,15 +250,89 @@ struct object_t
     bool is_cell()    const noexcept {return std::holds_alternative<cell_t      >(data);}
     bool is_func()    const noexcept {return std::holds_alternative<func_t      >(data);}
     bool is_builtin() const noexcept {return std::holds_alternative<builtin_t   >(data);}
+    bool is_chan()    const noexcept {return std::holds_alternative<chan_t      >(data);}
 
-    std::variant<nil_t, true_t, std::int64_t, std::string, symbol_t, cell_t, func_t, builtin_t>
+    std::variant<nil_t, true_t, std::int64_t, std::string, symbol_t, cell_t, func_t, builtin_t, chan_t>
         data;
 };
 
+struct cell_node_t
+{
+    cell_node_t()  = default;
+    ~cell_node_t();
+    cell_node_t(cell_node_t const& other): objs(other.objs) {} // not interned
+    cell_node_t(cell_node_t&&)      = delete;
+    cell_node_t& operator=(cell_node_t const&) = delete;
+    cell_node_t& operator=(cell_node_t&&)      = delete;
+
+    std::array<object_t, 2> objs;
+    std::size_t   hash  = 0; // structural hash. cached only if interned
+    std::uint64_t table = 0; // id of cell_table that interned this, or 0
+};
+
+inline cell_node_t::~cell_node_t()
+{
+    // release the uniquely-owned tail of a list iteratively. otherwise, a
+    // long list overflows the stack by recursive destructor calls.
+    std::shared_ptr<cell_node_t> next;
+    if(auto* tail = std::get_if<cell_t>(std::addressof(objs.back().data)))
+    {
+        next = std::move(tail->node);
+    }
+    while(next && next.use_count() == 1)
+    {
+        std::shared_ptr<cell_node_t> after;
+        if(auto* tail = std::get_if<cell_t>(std::addressof(next->objs.back().data)))
+        {
+            after = std::move(tail->node);
+        }
+        next = std::move(after);
+    }
+}
+
+inline cell_t::cell_t(): node(std::make_shared<cell_node_t>()) {}
+
+// returns a node that can be modified without affecting other cells.
+// interned nodes are immutable, so they are always copied.
+inline cell_node_t& mutate(cell_t& cell)
+{
+    if(cell.node.use_count() != 1 || cell.node->table != 0)
+    {
+        cell.node = std::make_shared<cell_node_t>(*cell.node);
+    }
+    return *cell.node;
+}
+
+inline object_t const& car(cell_t const& cell) noexcept {return cell.node->objs.front();}
+inline object_t&       car(cell_t&       cell)          {return mutate(cell).objs.front();}
+inline object_t const& cdr(cell_t const& cell) noexcept {return cell.node->objs.back();}
+inline object_t&       cdr(cell_t&       cell)          {return mutate(cell).objs.back();}
+
+inline bool operator==(const cell_t& lhs, const cell_t& rhs) noexcept
+{
+    const cell_node_t& l = *lhs.node;
+    const cell_node_t& r = *rhs.node;
+    if(lhs.node == rhs.node)
+    {
+        return true;
+    }
+    if(l.table != 0 && r.table != 0)
+    {
+        // a table never has two nodes with the same structure
+        if(l.table == r.table || l.hash != r.hash) {return false;}
+    }
+    return l.objs == r.objs;
+}
+inline bool operator<(const cell_t& lhs, const cell_t& rhs) noexcept
+{
+    if(lhs.node == rhs.node) {return false;}
+    return lhs.node->objs < rhs.node->objs;
+}
+
 inline object_t const& car(object_t const& cell) noexcept {return car(std::get<cell_t>(cell.data));}
-inline object_t&       car(object_t&       cell) noexcept {return car(std::get<cell_t>(cell.data));}
+inline object_t&       car(object_t&       cell)          {return car(std::get<cell_t>(cell.data));}
 inline object_t const& cdr(object_t const& cell) noexcept {return cdr(std::get<cell_t>(cell.data));}
-inline object_t&       cdr(object_t&       cell) noexcept {return cdr(std::get<cell_t>(cell.data));}
+inline object_t&       cdr(object_t&       cell)          {return cdr(std::get<cell_t>(cell.data));}
 
 inline bool operator==(const object_t& lhs, const object_t& rhs) noexcept {return lhs.data == rhs.data;}
 inline bool operator!=(const object_t& lhs, const object_t& rhs) noexcept {return lhs.data != rhs.data;}
@@ -255,7 +368,26 @@ struct env_t
     object_t&       at(const symbol_t& sym)       {return objs[sym];}
     object_t const& at(const symbol_t& sym) const {return objs.at(sym);}
 
-    std::map<symbol_t, object_t> objs;
+    // searches this frame and then the parents. returns nullptr if not found.
+    object_t const* find(const symbol_t& sym) const
+    {
+        for(const env_t* frame = this; frame != nullptr; frame = frame->parent)
+        {
+            const auto found = frame->objs.find(sym);
+            if(found != frame->objs.end())
+            {
+                return std::addressof(found->second);
+            }
+        }
+        return nullptr;
+    }
+
+    env_t&       root()       noexcept {return parent ? parent->root() : *this;}
+    env_t const& root() const noexcept {return parent ? parent->root() : *this;}
+
+    std::map<symbol_t, object_t> objs; // bindings in this frame
+    std::shared_ptr<runtime_t>   rt;   // shared by copies. may be null
+    env_t*                       parent = nullptr; // outlives this frame
 };
 
 } // sml
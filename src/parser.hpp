@@ -4,36 +4,39 @@
 #include "eval.hpp"
 #include "builtin.hpp"
 #include <fstream>
+#include <istream>
+#include <streambuf>
 #include <string>
+#include <string_view>
 #include <cassert>
 #include <cctype>
 #include <iostream>
+#include <iterator>
+#include <filesystem>
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <thread>
+#include <limits>
+#include <optional>
+#include <stdexcept>
 
 namespace sml
 {
 
-inline env_t init_env()
+// an error while reading. `depth` is the number of lists left open by it,
+// so that a reader of a stream can skip the rest of the broken expression.
+struct parse_error : public std::runtime_error
 {
-    env_t env;
-    env["nil"]     = object_t(nil_t{});
-    env["T"]       = object_t(true_t{});
-    env["+"]       = builtin_t("builtin_plus",    builtin_plus);
-    env["-"]       = builtin_t("builtin_minus",   builtin_minus);
-    env["%"]       = builtin_t("builtin_mod",     builtin_mod);
-    env["="]       = builtin_t("builtin_eq",      builtin_eq);
-    env["<"]       = builtin_t("builtin_lt",      builtin_lt);
-    env["car"]     = builtin_t("builtin_car",     builtin_car);
-    env["cdr"]     = builtin_t("builtin_cdr",     builtin_cdr);
-    env["let"]     = builtin_t("builtin_let",     builtin_let);
-    env["define"]  = builtin_t("builtin_define",  builtin_define);
-    env["println"] = builtin_t("builtin_println", builtin_println);
-    env["if"]      = builtin_t("builtin_if",      builtin_if);
-    env["while"]   = builtin_t("builtin_while",   builtin_while);
-    return env;
-}
+    parse_error(const std::string& what, std::size_t d)
+        : std::runtime_error(what), depth(d)
+    {}
+
+    std::size_t depth;
+};
 
 template<typename charT, typename traits>
-object_t read_number(std::basic_ifstream<charT, traits>& file, char sign)
+object_t read_number(std::basic_istream<charT, traits>& file, char sign)
 {
     std::string token;
     while(not file.eof())
@@ -47,15 +50,20 @@ object_t read_number(std::basic_ifstream<charT, traits>& file, char sign)
             break;
         }
     }
-    if(sign == '-')
+    std::int64_t value = 0;
+    try
+    {
+        value = std::int64_t(std::stoll(token));
+    }
+    catch(const std::out_of_range&)
     {
-        return object_t(-std::int64_t(std::stoll(token)));
+        throw parse_error("[error] number out of range -> " + token, 0);
     }
-    return object_t(std::int64_t(std::stoll(token)));
+    return object_t(sign == '-' ? -value : value);
 }
 
 template<typename charT, typename traits>
-object_t read_string(std::basic_ifstream<charT, traits>& file)
+object_t read_string(std::basic_istream<charT, traits>& file)
 {
     std::string token;
     while(not file.eof())
@@ -74,7 +82,7 @@ object_t read_string(std::basic_ifstream<charT, traits>& file)
 }
 
 template<typename charT, typename traits>
-object_t read_symbol(std::basic_ifstream<charT, traits>& file)
+object_t read_symbol(std::basic_istream<charT, traits>& file)
 {
     std::string token;
     while(not file.eof())
@@ -92,43 +100,59 @@ object_t read_symbol(std::basic_ifstream<charT, traits>& file)
 }
 
 template<typename charT, typename traits>
-object_t read_expr(std::basic_ifstream<charT, traits>& file);
+object_t read_expr(std::basic_istream<charT, traits>& file);
+
+template<typename charT, typename traits>
+bool skip_blank(std::basic_istream<charT, traits>& file);
 
 template<typename charT, typename traits>
-object_t read_list(std::basic_ifstream<charT, traits>& file)
+object_t read_list(std::basic_istream<charT, traits>& file)
 {
     assert(file.get() == '(');
 
-    object_t list(cell_t{});
-    car(std::get<cell_t>(list.data)) = read_expr(file);
-
-    object_t* cons = std::addressof(cdr(std::get<cell_t>(list.data)));
-
-    file.peek();
-    while(not file.eof())
+    if(skip_blank(file) && file.peek() == ')')
     {
-        const char c = file.get();
-        if(file.eof()) {return list;}
+        file.ignore(1);
+        throw parse_error("[error] empty list", 0);
+    }
+    try
+    {
+        object_t list(cell_t{});
+        car(std::get<cell_t>(list.data)) = read_expr(file);
 
-        if(c == ' ' || c == '\n' || c == '\t' || c == '\r')
-        {
-            continue;
-        }
-        if(c == ')')
+        object_t* cons = std::addressof(cdr(std::get<cell_t>(list.data)));
+
+        file.peek();
+        while(not file.eof())
         {
-            return list;
-        }
-        file.unget();
+            const char c = file.get();
+            if(file.eof()) {return list;}
+
+            if(c == ' ' || c == '\n' || c == '\t' || c == '\r')
+            {
+                continue;
+            }
+            if(c == ')')
+            {
+                return list;
+            }
+            file.unget();
 
-        *cons = cell_t{};
-        car(std::get<cell_t>(cons->data)) = read_expr(file);
-        cons = std::addressof(cdr(std::get<cell_t>(cons->data)));
+            *cons = cell_t{};
+            car(std::get<cell_t>(cons->data)) = read_expr(file);
+            cons = std::addressof(cdr(std::get<cell_t>(cons->data)));
+        }
+        throw parse_error("[error] list did not closed", 0);
+    }
+    catch(parse_error& err)
+    {
+        err.depth += 1; // this list is left open
+        throw;
     }
-    throw std::runtime_error("[error] list did not closed");
 }
 
 template<typename charT, typename traits>
-object_t read_expr(std::basic_ifstream<charT, traits>& file)
+object_t read_expr(std::basic_istream<charT, traits>& file)
 {
     object_t expr(nil);
     std::string token;
@@ -205,15 +229,407 @@ object_t read_expr(std::basic_ifstream<charT, traits>& file)
             return read_list(file);
         }
 
-        file.unget();
-        file >> token;
-        throw std::runtime_error(
-                "[error] couldn't parse the next token -> " + token);
+        // the token ends before a paren so that the lists stay balanced
+        token += c;
+        while(not file.eof())
+        {
+            const auto next = file.peek();
+            if(next == traits::eof() || std::isspace(next) || next == '(' || next == ')')
+            {
+                break;
+            }
+            token += file.get();
+        }
+        throw parse_error("[error] couldn't parse the next token -> " + token, 0);
     }
     // EOF.
     return object_t(nil);
 }
 
+// skips whitespaces and comments. returns false if it reaches EOF.
+template<typename charT, typename traits>
+bool skip_blank(std::basic_istream<charT, traits>& file)
+{
+    while(true)
+    {
+        const auto c = file.peek();
+        if(c == traits::eof())
+        {
+            return false;
+        }
+        if(c == ' ' || c == '\n' || c == '\t' || c == '\r')
+        {
+            file.ignore(1);
+        }
+        else if(c == ';')
+        {
+            file.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+        }
+        else
+        {
+            return true;
+        }
+    }
+}
+
+// skips the rest of an expression that has `depth` lists left open, e.g.
+// after a parse_error. returns false if it reaches EOF.
+template<typename charT, typename traits>
+bool skip_lists(std::basic_istream<charT, traits>& file, std::size_t depth)
+{
+    while(depth != 0)
+    {
+        const auto c = file.get();
+        if(c == traits::eof())
+        {
+            return false;
+        }
+        if(c == '(')
+        {
+            depth += 1;
+        }
+        else if(c == ')')
+        {
+            depth -= 1;
+        }
+        else if(c == '"')
+        {
+            file.ignore(std::numeric_limits<std::streamsize>::max(), '"');
+        }
+        else if(c == ';')
+        {
+            file.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+        }
+    }
+    return true;
+}
+
+// reads the next expression. unlike read_expr, EOF is distinguished from
+// an expression that is nil; it returns std::nullopt only at EOF.
+template<typename charT, typename traits>
+std::optional<object_t> try_read_expr(std::basic_istream<charT, traits>& file)
+{
+    if(not skip_blank(file))
+    {
+        return std::nullopt;
+    }
+    return read_expr(file);
+}
+
+// read-only streambuf that refers an in-memory source without copying it.
+// the viewed buffer must outlive the streambuf.
+struct viewbuf : public std::streambuf
+{
+    explicit viewbuf(std::string_view sv)
+    {
+        // streambuf never writes to get area, so const_cast is safe here
+        char* first = const_cast<char*>(sv.data());
+        this->setg(first, first, first + sv.size());
+    }
+    ~viewbuf() override = default;
+
+    viewbuf(viewbuf const&) = delete;
+    viewbuf(viewbuf&&)      = delete;
+    viewbuf& operator=(viewbuf const&) = delete;
+    viewbuf& operator=(viewbuf&&)      = delete;
+};
+
+inline std::vector<object_t> read_exprs(std::string_view src)
+{
+    viewbuf buf(src);
+    std::istream is(&buf);
+
+    std::vector<object_t> exprs;
+    while(auto expr = try_read_expr(is))
+    {
+        exprs.push_back(std::move(*expr));
+    }
+    return exprs;
+}
+
+// returns offsets in `src` to split it into about `n` chunks so that each
+// chunk contains whole top-level expressions. it only tracks parens,
+// strings and comments, so it is much faster than parsing.
+inline std::vector<std::size_t> split_exprs(std::string_view src, std::size_t n)
+{
+    std::vector<std::size_t> offsets{0};
+    const std::size_t width = src.size() / std::max<std::size_t>(n, 1) + 1;
+
+    std::size_t next  = width;
+    std::size_t depth = 0;
+    for(std::size_t i=0; i<src.size(); ++i)
+    {
+        const char c = src[i];
+        if(c == '"')
+        {
+            const auto close = src.find('"', i + 1);
+            if(close == std::string_view::npos) {break;}
+            i = close;
+            continue;
+        }
+        if(c == ';')
+        {
+            if(depth == 0 && next <= i) // a comment starts a new chunk
+            {
+                offsets.push_back(i);
+                next = i + width;
+            }
+            const auto newline = src.find('\n', i + 1);
+            if(newline == std::string_view::npos) {break;}
+            i = newline;
+            continue;
+        }
+        if(depth == 0 && next <= i &&
+           (c == '(' || c == ' ' || c == '\n' || c == '\t' || c == '\r'))
+        {
+            offsets.push_back(i);
+            next = i + width;
+        }
+        if(c == '(')
+        {
+            ++depth;
+        }
+        else if(c == ')' && depth != 0)
+        {
+            --depth;
+        }
+    }
+    offsets.push_back(src.size());
+    return offsets;
+}
+
+// expressions read until the first error.
+struct parsed_t
+{
+    parsed_t()  = default;
+    ~parsed_t() = default;
+    parsed_t(parsed_t const&) = default;
+    parsed_t(parsed_t&&)      = default;
+    parsed_t& operator=(parsed_t const&) = default;
+    parsed_t& operator=(parsed_t&&)      = default;
+
+    std::vector<object_t> exprs;
+    std::exception_ptr    error; // null if all the source was read
+};
+
+inline parsed_t read_exprs_partial(std::string_view src)
+{
+    viewbuf buf(src);
+    std::istream is(&buf);
+
+    parsed_t parsed;
+    try
+    {
+        while(auto expr = try_read_expr(is))
+        {
+            parsed.exprs.push_back(std::move(*expr));
+        }
+    }
+    catch(...)
+    {
+        parsed.error = std::current_exception();
+    }
+    return parsed;
+}
+
+// reads a large source by splitting it at top-level expressions and parsing
+// the chunks on `threads` threads. the result is the same as reading serially.
+inline parsed_t read_exprs_parallel(std::string_view src,
+        std::size_t threads = std::thread::hardware_concurrency())
+{
+    constexpr std::size_t min_chunk = 1 << 20; // smaller source is read serially
+    threads = std::min(std::max<std::size_t>(threads, 1), src.size() / min_chunk);
+    if(threads <= 1)
+    {
+        return read_exprs_partial(src);
+    }
+
+    // more chunks than threads to balance the load
+    const auto offsets = split_exprs(src, threads * 4);
+    std::vector<parsed_t> chunks(offsets.size() - 1);
+
+    std::atomic<std::size_t> next_chunk{0};
+    const auto worker = [&]() {
+        for(std::size_t i = next_chunk++; i < chunks.size(); i = next_chunk++)
+        {
+            chunks[i] = read_exprs_partial(
+                src.substr(offsets[i], offsets[i+1] - offsets[i]));
+        }
+    };
+    std::vector<std::thread> pool;
+    for(std::size_t i=1; i<threads; ++i)
+    {
+        pool.emplace_back(worker);
+    }
+    worker();
+    for(auto& th : pool)
+    {
+        th.join();
+    }
+
+    parsed_t parsed = std::move(chunks.front());
+    for(auto iter = std::next(chunks.begin()); iter != chunks.end(); ++iter)
+    {
+        if(parsed.error)
+        {
+            break;
+        }
+        parsed.exprs.insert(parsed.exprs.end(),
+                            std::make_move_iterator(iter->exprs.begin()),
+                            std::make_move_iterator(iter->exprs.end()));
+        parsed.error = iter->error;
+    }
+    return parsed;
+}
+
+// reads whole content of a file.
+inline std::string read_file(const std::filesystem::path& path)
+{
+    std::ifstream ifs(path, std::ios::binary);
+    if(not ifs.good())
+    {
+        throw std::runtime_error("[error] couldn't open " + path.string());
+    }
+    std::string src;
+    ifs.seekg(0, std::ios::end);
+    const auto size = ifs.tellg();
+    if(size < 0) // pipes and FIFOs can't seek. read until EOF
+    {
+        ifs.clear();
+        src.assign(std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>());
+        if(ifs.bad())
+        {
+            throw std::runtime_error("[error] couldn't read " + path.string());
+        }
+        return src;
+    }
+    src.resize(static_cast<std::size_t>(size));
+    ifs.seekg(0, std::ios::beg);
+    if(not ifs.read(src.data(), static_cast<std::streamsize>(src.size())))
+    {
+        throw std::runtime_error("[error] couldn't read " + path.string());
+    }
+    return src;
+}
+
+inline std::shared_ptr<const module_t>
+load_module(const std::filesystem::path& path, module_cache& cache,
+            cell_table* cells = nullptr)
+{
+    std::error_code ec;
+    const auto mtime = std::filesystem::last_write_time(path, ec);
+    if(ec)
+    {
+        throw std::runtime_error("[error] couldn't open " + path.string());
+    }
+    if(auto found = cache.find(path, mtime))
+    {
+        return found;
+    }
+
+    parsed_t parsed = read_exprs_parallel(read_file(path));
+    if(parsed.error)
+    {
+        std::rethrow_exception(parsed.error);
+    }
+    if(cells) // deduplicate the lists before caching
+    {
+        for(auto& expr : parsed.exprs)
+        {
+            expr = cells->intern(expr);
+        }
+    }
+    module_t mod;
+    mod.path  = path;
+    mod.mtime = mtime;
+    mod.exprs = std::move(parsed.exprs);
+    return cache.insert(std::move(mod));
+}
+
+inline object_t builtin_require(const object_t& cons, env_t& env)
+{
+    // (require "path") evaluates the file once. returns T.
+    const object_t file = eval(car(cons), env);
+    if(not file.is_string())
+    {
+        throw std::runtime_error("[error] (require \"<path>\")");
+    }
+    if(not env.rt)
+    {
+        env.rt = std::make_shared<runtime_t>();
+    }
+
+    // a relative path is relative to the file that requires it
+    std::filesystem::path path = std::get<std::string>(file.data);
+    if(path.is_relative())
+    {
+        path = env.rt->module_dir / path;
+    }
+    std::error_code ec;
+    auto canonical = std::filesystem::weakly_canonical(path, ec);
+    if(not ec)
+    {
+        path = std::move(canonical);
+    }
+    // mark it first so that circular requires terminate
+    if(not env.rt->loaded.insert(path).second)
+    {
+        return object_t(true_t{});
+    }
+
+    // definitions go to the root env even if it is required in a function
+    env_t& root = env.root();
+    cell_table* cells = env.rt->cells.get();
+    const auto outer_dir = env.rt->module_dir;
+    env.rt->module_dir = path.parent_path();
+    try
+    {
+        const auto mod = load_module(path, *env.rt->modules, cells);
+        for(const auto& expr : mod->exprs)
+        {
+            // a module cached by another interpreter may not be interned yet.
+            // intern is O(1) for lists already interned by the same table.
+            eval(cells ? cells->intern(expr) : expr, root);
+        }
+    }
+    catch(...)
+    {
+        env.rt->module_dir = outer_dir;
+        env.rt->loaded.erase(path); // so that it can be required again
+        throw;
+    }
+    env.rt->module_dir = outer_dir;
+    return object_t(true_t{});
+}
+
+inline env_t init_env()
+{
+    env_t env;
+    env.rt            = std::make_shared<runtime_t>();
+    env["nil"]        = object_t(nil_t{});
+    env["T"]          = object_t(true_t{});
+    env["+"]          = builtin_t("builtin_plus",       builtin_plus);
+    env["-"]          = builtin_t("builtin_minus",      builtin_minus);
+    env["%"]          = builtin_t("builtin_mod",        builtin_mod);
+    env["="]          = builtin_t("builtin_eq",         builtin_eq);
+    env["<"]          = builtin_t("builtin_lt",         builtin_lt);
+    env["car"]        = builtin_t("builtin_car",        builtin_car);
+    env["cdr"]        = builtin_t("builtin_cdr",        builtin_cdr);
+    env["let"]        = builtin_t("builtin_let",        builtin_let);
+    env["define"]     = builtin_t("builtin_define",     builtin_define);
+    env["println"]    = builtin_t("builtin_println",    builtin_println);
+    env["if"]         = builtin_t("builtin_if",         builtin_if);
+    env["while"]      = builtin_t("builtin_while",      builtin_while);
+    env["stats"]      = builtin_t("builtin_stats",      builtin_stats);
+    env["require"]    = builtin_t("builtin_require",    builtin_require);
+    env["spawn"]      = builtin_t("builtin_spawn",      builtin_spawn);
+    env["chan"]       = builtin_t("builtin_chan",       builtin_chan);
+    env["send"]       = builtin_t("builtin_send",       builtin_send);
+    env["recv"]       = builtin_t("builtin_recv",       builtin_recv);
+    env["close"]      = builtin_t("builtin_close",      builtin_close);
+    env["open-input"] = builtin_t("builtin_open_input", builtin_open_input);
+    return env;
+}
 
 } // sml
 #endif // SMALLISP_PARSER_HPP
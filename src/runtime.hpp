@@ -0,0 +1,283 @@
+#ifndef SMALLISP_RUNTIME_HPP
+#define SMALLISP_RUNTIME_HPP
+#include "object.hpp"
+#include "module.hpp"
+#include "hashcons.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <ostream>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+namespace sml
+{
+
+class scheduler_t; // scheduler.hpp
+
+// hard limits of an interpreter. 0 means unlimited.
+// the eval steps are counted for each top-level evaluation. the depth is
+// limited by default because a runaway recursion overflows the stack before
+// it exceeds the steps. an eval takes about 500 bytes of stack, so the
+// default fits in the 8 MiB stacks of the main thread and the tasks.
+struct limits_t
+{
+    std::size_t   max_heap_bytes = 0;
+    std::uint64_t max_eval_steps = 0;
+    std::size_t   max_depth      = 10000;
+};
+
+// objects reachable from an env. a node shared by several lists is counted
+// once. bytes are approximate; they include the node and its buffers.
+struct heap_usage_t
+{
+    std::size_t cells        = 0;
+    std::size_t cell_bytes   = 0;
+    std::size_t strings      = 0;
+    std::size_t string_bytes = 0;
+    std::size_t funcs        = 0;
+    std::size_t func_bytes   = 0;
+
+    std::size_t objects() const noexcept {return cells + strings + funcs;}
+    std::size_t bytes()   const noexcept {return cell_bytes + string_bytes + func_bytes;}
+};
+
+struct stats_t
+{
+    heap_usage_t  heap;           // as of the last measurement
+    std::size_t   peak_bytes = 0; // max of the measured heap bytes. see track_heap
+    std::uint64_t evals      = 0;
+    std::uint64_t applies    = 0;
+    std::size_t   depth      = 0;
+    std::size_t   max_depth  = 0;
+};
+
+// state shared by all the copies of an env made during evaluation.
+struct runtime_t
+{
+    stats_t       stats;
+    limits_t      limits;
+    std::uint64_t step_origin     = 0; // evals when the current top-level eval started
+    std::uint64_t measured_at     = 0; // evals when heap was measured last
+    std::uint64_t next_heap_check = 0; // eval step to measure heap next
+    std::size_t   allocated       = 0; // bytes allocated since the last measurement
+    bool          track_heap      = false; // keep the peak up to date, e.g. for --stats
+
+    std::set<std::filesystem::path> loaded;     // modules required so far
+    std::filesystem::path           module_dir; // relative requires are resolved against it
+    std::shared_ptr<module_cache>   modules = std::make_shared<module_cache>();
+
+    std::shared_ptr<scheduler_t> scheduler; // created when a task or channel is made
+    std::shared_ptr<cell_table>  cells;     // non-null if hash-consing is enabled
+};
+
+// hash-conses the lists in expressions read, if it is enabled.
+inline void intern_exprs(runtime_t& rt, std::vector<object_t>& exprs)
+{
+    if(rt.cells)
+    {
+        for(auto& expr : exprs)
+        {
+            expr = rt.cells->intern(expr);
+        }
+    }
+    return;
+}
+
+struct heap_counter
+{
+    void count(const object_t& obj)
+    {
+        const object_t* iter = std::addressof(obj);
+        while(iter) // follow cdr without recursion
+        {
+            iter = this->count_one(*iter);
+        }
+        return;
+    }
+
+    // counts `obj` itself and returns the tail to be counted next, if any.
+    object_t const* count_one(const object_t& obj)
+    {
+        if(const auto* str = std::get_if<std::string>(std::addressof(obj.data)))
+        {
+            usage.strings      += 1;
+            usage.string_bytes += sizeof(std::string) + str->capacity();
+        }
+        else if(const auto* fn = std::get_if<func_t>(std::addressof(obj.data)))
+        {
+            usage.funcs      += 1;
+            usage.func_bytes += sizeof(func_t) + fn->name.capacity() +
+                                fn->args.capacity() * sizeof(symbol_t);
+            for(const auto& arg : fn->args)
+            {
+                usage.func_bytes += arg.name.capacity();
+            }
+            return this->count_cell(fn->body);
+        }
+        else if(const auto* cell = std::get_if<cell_t>(std::addressof(obj.data)))
+        {
+            return this->count_cell(*cell);
+        }
+        return nullptr;
+    }
+
+    object_t const* count_cell(const cell_t& cell)
+    {
+        if(not visited.insert(cell.node.get()).second)
+        {
+            return nullptr;
+        }
+        usage.cells      += 1;
+        usage.cell_bytes += sizeof(cell_node_t) + 2 * sizeof(void*); // + control block
+        this->count(car(cell));
+        return std::addressof(cdr(cell));
+    }
+
+    heap_usage_t usage;
+    std::unordered_set<const cell_node_t*> visited;
+};
+
+inline heap_usage_t measure_heap(const env_t& env)
+{
+    heap_counter counter;
+    for(const env_t* frame = std::addressof(env); frame != nullptr; frame = frame->parent)
+    {
+        for(const auto& kv : frame->objs)
+        {
+            counter.count(kv.second);
+        }
+    }
+    return counter.usage;
+}
+
+inline heap_usage_t const& update_heap(runtime_t& rt, const env_t& env)
+{
+    rt.stats.heap       = measure_heap(env);
+    rt.allocated        = 0;
+    rt.measured_at      = rt.stats.evals;
+    rt.stats.peak_bytes = std::max(rt.stats.peak_bytes, rt.stats.heap.bytes());
+
+    // the cost of a measurement is amortized over the steps until the next
+    rt.next_heap_check = rt.stats.evals +
+        std::max<std::uint64_t>(4096, rt.stats.heap.objects());
+    return rt.stats.heap;
+}
+
+inline void check_heap_limit(runtime_t& rt, const env_t& env)
+{
+    if(rt.limits.max_heap_bytes < update_heap(rt, env).bytes())
+    {
+        throw std::runtime_error("[error] heap limit exceeded: " +
+            std::to_string(rt.stats.heap.bytes()) + " bytes");
+    }
+    return;
+}
+
+// called by builtins that allocate. a measurement is sampled by eval steps,
+// so this catches the growth faster than the sampling, like doubling a string.
+inline void charge_heap(runtime_t& rt, const env_t& env, std::size_t bytes)
+{
+    rt.allocated += bytes;
+    rt.stats.peak_bytes = std::max(rt.stats.peak_bytes, rt.stats.heap.bytes() + bytes);
+    if(rt.limits.max_heap_bytes != 0 &&
+       rt.limits.max_heap_bytes < rt.stats.heap.bytes() + rt.allocated)
+    {
+        check_heap_limit(rt, env);
+    }
+    return;
+}
+
+// starts a top-level evaluation. the eval step limit applies to each of them.
+inline void begin_toplevel(runtime_t& rt) noexcept
+{
+    rt.step_origin = rt.stats.evals;
+}
+
+// measures heap at the end of a top-level evaluation so that the peak covers
+// objects bound only for a while. a measurement walks all the live objects,
+// so it is done only if heap is tracked or limited, and skipped until enough
+// steps or allocations amortize it.
+inline void end_toplevel(runtime_t& rt, const env_t& env)
+{
+    if(not rt.track_heap && rt.limits.max_heap_bytes == 0)
+    {
+        return;
+    }
+    const heap_usage_t& heap = rt.stats.heap;
+    if(heap.objects() <= (rt.stats.evals - rt.measured_at) * 16 ||
+       heap.bytes()   <= rt.allocated * 16)
+    {
+        update_heap(rt, env);
+    }
+    return;
+}
+
+// counts an eval and its depth while it is alive. throws if it exceeds limits.
+struct eval_guard
+{
+    eval_guard(runtime_t* r, const env_t& env): rt(r)
+    {
+        if(not rt) {return;}
+
+        stats_t& stats = rt->stats;
+        stats.evals += 1;
+        stats.depth += 1;
+        stats.max_depth = std::max(stats.max_depth, stats.depth);
+
+        const limits_t& limits = rt->limits;
+        if(limits.max_eval_steps != 0 &&
+           limits.max_eval_steps < stats.evals - rt->step_origin)
+        {
+            stats.depth -= 1;
+            throw std::runtime_error("[error] eval step limit exceeded");
+        }
+        if(limits.max_depth != 0 && limits.max_depth < stats.depth)
+        {
+            stats.depth -= 1;
+            throw std::runtime_error("[error] recursion depth limit exceeded");
+        }
+        if(limits.max_heap_bytes != 0 && rt->next_heap_check <= stats.evals)
+        {
+            try
+            {
+                check_heap_limit(*rt, env);
+            }
+            catch(...)
+            {
+                stats.depth -= 1;
+                throw;
+            }
+        }
+    }
+    ~eval_guard()
+    {
+        if(rt) {rt->stats.depth -= 1;}
+    }
+
+    eval_guard(eval_guard const&) = delete;
+    eval_guard(eval_guard&&)      = delete;
+    eval_guard& operator=(eval_guard const&) = delete;
+    eval_guard& operator=(eval_guard&&)      = delete;
+
+    runtime_t* rt;
+};
+
+template<typename charT, typename traits>
+std::basic_ostream<charT, traits>&
+operator<<(std::basic_ostream<charT, traits>& os, const stats_t& stats)
+{
+    os << "cells:     " << stats.heap.cells   << " (" << stats.heap.cell_bytes   << " bytes)\n";
+    os << "strings:   " << stats.heap.strings << " (" << stats.heap.string_bytes << " bytes)\n";
+    os << "funcs:     " << stats.heap.funcs   << " (" << stats.heap.func_bytes   << " bytes)\n";
+    os << "heap:      " << stats.heap.bytes() << " bytes (peak " << stats.peak_bytes << ")\n";
+    os << "evals:     " << stats.evals        << '\n';
+    os << "applies:   " << stats.applies      << '\n';
+    os << "max-depth: " << stats.max_depth;
+    return os;
+}
+
+} // sml
+#endif // SMALLISP_RUNTIME_HPP
@@ -0,0 +1,504 @@
+#ifndef SMALLISP_SCHEDULER_HPP
+#define SMALLISP_SCHEDULER_HPP
+#include "object.hpp"
+#include "runtime.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+namespace sml
+{
+
+// a green thread. it has its own stack and runs until it blocks.
+struct task_t
+{
+    task_t()  = default;
+    ~task_t()
+    {
+        if(stack != nullptr) {::munmap(stack, stack_size);}
+    }
+    task_t(task_t const&) = delete;
+    task_t(task_t&&)      = delete;
+    task_t& operator=(task_t const&) = delete;
+    task_t& operator=(task_t&&)      = delete;
+
+    ucontext_t            ctx;
+    void*                 stack      = nullptr;
+    std::size_t           stack_size = 0;
+    std::function<void()> body;
+    bool                  ready      = false; // in the ready queue
+    bool                  finished   = false;
+    bool                  cancelled  = false; // unwinds when it is resumed
+    std::size_t           depth      = 0;     // eval depth while suspended
+};
+
+// thrown in a cancelled task to unwind its stack. it is not a std::exception
+// so that nothing but the scheduler catches it.
+struct task_cancelled {};
+
+class scheduler_t;
+
+// bounded queue of objects. if `fd` is valid, it is an input port and lines
+// read from the fd are put in the buffer when a task receives from it.
+struct channel_t
+{
+    explicit channel_t(std::size_t cap): capacity(std::max<std::size_t>(cap, 1)) {}
+    ~channel_t(); // defined after scheduler_t
+    channel_t(channel_t const&) = delete;
+    channel_t(channel_t&&)      = delete;
+    channel_t& operator=(channel_t const&) = delete;
+    channel_t& operator=(channel_t&&)      = delete;
+
+    std::size_t          capacity;
+    std::deque<object_t> buffer;
+    std::deque<task_t*>  senders;   // blocked because the buffer is full
+    std::deque<task_t*>  receivers; // blocked because the buffer is empty
+    bool                 closed = false;
+
+    int                  fd         = -1;
+    bool                 pollable   = false; // regular files can't be polled
+    bool                 registered = false; // added to epoll
+    bool                 armed      = false; // waiting for an event
+    std::string          partial;            // incomplete last line
+    std::weak_ptr<scheduler_t> owner;        // whose epoll it is added to
+};
+
+// cooperative scheduler. a task runs until it waits on a channel; then the
+// next ready task runs. when no task is ready, it waits for the input ports
+// by epoll. the thread that created it runs as the root task.
+// the eval depth counter is saved and restored per task so that it measures
+// the stack of the running task only.
+class scheduler_t : public std::enable_shared_from_this<scheduler_t>
+{
+  public:
+
+    explicit scheduler_t(std::size_t* depth = nullptr,
+                         std::size_t stack_size = 8 << 20) // committed lazily
+        : current_(std::addressof(root_)), depth_(depth), stack_size_(stack_size)
+    {}
+    ~scheduler_t()
+    {
+        if(epfd_ >= 0) {::close(epfd_);}
+    }
+    scheduler_t(scheduler_t const&) = delete;
+    scheduler_t(scheduler_t&&)      = delete;
+    scheduler_t& operator=(scheduler_t const&) = delete;
+    scheduler_t& operator=(scheduler_t&&)      = delete;
+
+    void spawn(std::function<void()> body)
+    {
+        this->reap();
+
+        auto task = std::make_unique<task_t>();
+        const std::size_t page = static_cast<std::size_t>(::sysconf(_SC_PAGESIZE));
+        task->stack_size = stack_size_ + page;
+        task->stack = ::mmap(nullptr, task->stack_size, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+        if(task->stack == MAP_FAILED)
+        {
+            task->stack = nullptr;
+            throw std::runtime_error("[error] couldn't allocate a task stack");
+        }
+        ::mprotect(task->stack, page, PROT_NONE); // guard page
+
+        ::getcontext(std::addressof(task->ctx));
+        task->ctx.uc_stack.ss_sp   = task->stack;
+        task->ctx.uc_stack.ss_size = task->stack_size;
+        task->ctx.uc_link          = nullptr;
+        const auto self = reinterpret_cast<std::uintptr_t>(this);
+        ::makecontext(std::addressof(task->ctx), reinterpret_cast<void(*)()>(&trampoline),
+                      2, static_cast<std::uint32_t>(self >> 32),
+                         static_cast<std::uint32_t>(self & 0xFFFFFFFF));
+        task->body = std::move(body);
+
+        live_ += 1;
+        this->make_ready(task.get());
+        tasks_.push_back(std::move(task));
+        return;
+    }
+
+    // blocks the current task until `notify` pops it from `queue`.
+    void wait(std::deque<task_t*>& queue)
+    {
+        queue.push_back(current_);
+        try
+        {
+            this->suspend();
+        }
+        catch(...)
+        {
+            queue.erase(std::remove(queue.begin(), queue.end(), current_), queue.end());
+            throw;
+        }
+        return;
+    }
+    void notify(std::deque<task_t*>& queue)
+    {
+        if(not queue.empty())
+        {
+            this->make_ready(queue.front());
+            queue.pop_front();
+        }
+        return;
+    }
+    void notify_all(std::deque<task_t*>& queue)
+    {
+        while(not queue.empty())
+        {
+            this->notify(queue);
+        }
+        return;
+    }
+
+    // called from the root. runs tasks until all of them finish.
+    void run()
+    {
+        root_waits_ = true;
+        try
+        {
+            while(live_ != 0)
+            {
+                this->suspend();
+            }
+        }
+        catch(...)
+        {
+            root_waits_ = false;
+            throw;
+        }
+        root_waits_ = false;
+        this->reap();
+        return;
+    }
+
+    // called from the root. runs the ready tasks until each of them finishes
+    // or blocks. unlike run(), it doesn't wait for the blocked ones.
+    void run_ready()
+    {
+        if(in_task())
+        {
+            return;
+        }
+        if(armed_ != 0)
+        {
+            this->wait_ports(0);
+        }
+        while(not ready_.empty())
+        {
+            this->make_ready(std::addressof(root_)); // come back after them
+            this->suspend();
+        }
+        this->reap();
+        return;
+    }
+
+    // reads the port if it is readable without blocking the process.
+    // otherwise, registers it to epoll and the caller should `wait`.
+    bool poll_port(channel_t& ch)
+    {
+        if(not ch.pollable)
+        {
+            this->fill(ch);
+            return true;
+        }
+        if(not ch.armed)
+        {
+            if(epfd_ < 0)
+            {
+                epfd_ = ::epoll_create1(EPOLL_CLOEXEC);
+                if(epfd_ < 0) {throw std::runtime_error("[error] epoll_create1 failed");}
+            }
+            epoll_event ev;
+            ev.events   = EPOLLIN | EPOLLONESHOT;
+            ev.data.ptr = std::addressof(ch);
+            const int op = ch.registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+            if(::epoll_ctl(epfd_, op, ch.fd, std::addressof(ev)) != 0)
+            {
+                throw std::runtime_error(std::string("[error] epoll_ctl failed: ") +
+                                         std::strerror(errno));
+            }
+            ch.registered = true;
+            ch.armed      = true;
+            ch.owner      = this->weak_from_this();
+            armed_ += 1;
+        }
+        return false;
+    }
+
+    // removes the port from epoll, e.g. when it is closed or no task waits.
+    void disarm(channel_t& ch) noexcept
+    {
+        if(ch.armed)
+        {
+            ch.armed = false;
+            armed_  -= 1;
+        }
+        if(ch.registered && ch.fd >= 0 && epfd_ >= 0)
+        {
+            ::epoll_ctl(epfd_, EPOLL_CTL_DEL, ch.fd, nullptr);
+        }
+        ch.registered = false;
+        return;
+    }
+
+    // reads available data of the port into its buffer line by line.
+    void fill(channel_t& ch)
+    {
+        if(ch.closed || ch.fd < 0)
+        {
+            return;
+        }
+        char buf[1 << 16];
+        const ::ssize_t len = ::read(ch.fd, buf, sizeof(buf));
+        if(len < 0)
+        {
+            if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {return;}
+            throw std::runtime_error(std::string("[error] read failed: ") +
+                                     std::strerror(errno));
+        }
+        if(len == 0) // EOF
+        {
+            if(not ch.partial.empty())
+            {
+                ch.buffer.push_back(object_t(std::move(ch.partial)));
+                ch.partial.clear();
+            }
+            ch.closed = true;
+            ::close(ch.fd); // it also removes fd from epoll
+            ch.fd = -1;
+            ch.registered = false;
+            return;
+        }
+        std::string_view data(buf, static_cast<std::size_t>(len));
+        while(not data.empty())
+        {
+            const auto newline = data.find('\n');
+            if(newline == std::string_view::npos)
+            {
+                ch.partial.append(data.data(), data.size());
+                break;
+            }
+            ch.partial.append(data.data(), newline);
+            ch.buffer.push_back(object_t(std::move(ch.partial)));
+            ch.partial.clear();
+            data.remove_prefix(newline + 1);
+        }
+        return;
+    }
+
+    // called from the root. unwinds the tasks not finished yet, e.g. after an
+    // error or a deadlock, so that their stacks and captured envs are freed.
+    void cancel()
+    {
+        if(in_task())
+        {
+            return;
+        }
+        const auto clear_ready = [this]() {
+            for(task_t* task : ready_) {task->ready = false;}
+            ready_.clear();
+        };
+        for(std::size_t i=0; i<tasks_.size(); ++i)
+        {
+            task_t* task = tasks_[i].get();
+            if(task->finished)
+            {
+                continue;
+            }
+            clear_ready(); // a port polled while unwinding may wake tasks
+            task->cancelled = true;
+            this->switch_to(task);
+        }
+        clear_ready();
+        this->reap();
+        return;
+    }
+
+    bool in_task() const noexcept {return current_ != std::addressof(root_);}
+
+  private:
+
+    void make_ready(task_t* task)
+    {
+        if(not task->ready && not task->finished)
+        {
+            task->ready = true;
+            ready_.push_back(task);
+        }
+        return;
+    }
+
+    // switches to the next ready task. returns when the current is resumed.
+    void suspend()
+    {
+        // ports are also polled while tasks are ready so that they don't starve
+        if(armed_ != 0 && not ready_.empty() && ++switches_ % 64 == 0)
+        {
+            this->wait_ports(0);
+        }
+        while(ready_.empty())
+        {
+            if(armed_ != 0)
+            {
+                this->wait_ports(-1);
+                continue;
+            }
+            const auto deadlock = std::make_exception_ptr(
+                std::runtime_error("[error] deadlock: all tasks are blocked"));
+            if(not in_task())
+            {
+                this->cancel();
+                std::rethrow_exception(deadlock);
+            }
+            if(not error_) {error_ = deadlock;}
+            this->make_ready(std::addressof(root_));
+        }
+        task_t* next = ready_.front();
+        ready_.pop_front();
+        next->ready = false;
+
+        if(next != current_)
+        {
+            this->switch_to(next);
+        }
+        if(current_->cancelled)
+        {
+            throw task_cancelled{};
+        }
+        if(not in_task() && error_) // an error occurred in a task
+        {
+            auto err = error_;
+            error_ = nullptr;
+            this->cancel();
+            std::rethrow_exception(err);
+        }
+        return;
+    }
+
+    // returns when the current task is resumed.
+    void switch_to(task_t* next)
+    {
+        task_t* prev = current_;
+        current_ = next;
+        if(depth_)
+        {
+            prev->depth = *depth_;
+            *depth_     = next->depth;
+        }
+        ::swapcontext(std::addressof(prev->ctx), std::addressof(next->ctx));
+        return;
+    }
+
+    void wait_ports(int timeout)
+    {
+        epoll_event evs[16];
+        const int n = ::epoll_wait(epfd_, evs, 16, timeout);
+        if(n < 0)
+        {
+            if(errno == EINTR) {return;}
+            throw std::runtime_error(std::string("[error] epoll_wait failed: ") +
+                                     std::strerror(errno));
+        }
+        for(int i=0; i<n; ++i)
+        {
+            auto& ch = *static_cast<channel_t*>(evs[i].data.ptr);
+            ch.armed = false;
+            armed_  -= 1;
+            this->fill(ch);
+            this->notify_all(ch.receivers);
+        }
+        return;
+    }
+
+    void reap()
+    {
+        tasks_.erase(std::remove_if(tasks_.begin(), tasks_.end(),
+            [this](const std::unique_ptr<task_t>& t) {
+                return t->finished && t.get() != current_;
+            }), tasks_.end());
+        return;
+    }
+
+    static void trampoline(std::uint32_t hi, std::uint32_t lo)
+    {
+        auto* self = reinterpret_cast<scheduler_t*>(
+            (static_cast<std::uintptr_t>(hi) << 32) | static_cast<std::uintptr_t>(lo));
+        task_t* task = self->current_;
+        try
+        {
+            if(not task->cancelled) {task->body();}
+        }
+        catch(const task_cancelled&)
+        {
+            // unwound by cancel(). it returns to the root below
+        }
+        catch(...)
+        {
+            if(not self->error_) {self->error_ = std::current_exception();}
+            self->make_ready(std::addressof(self->root_));
+        }
+        task->body = nullptr; // release the env captured
+        task->finished = true;
+        self->live_ -= 1;
+        if(task->cancelled || (self->live_ == 0 && self->root_waits_))
+        {
+            self->make_ready(std::addressof(self->root_));
+        }
+        self->suspend(); // never resumed
+    }
+
+  private:
+
+    task_t                              root_;
+    task_t*                             current_;
+    std::deque<task_t*>                 ready_;
+    std::vector<std::unique_ptr<task_t>> tasks_;
+    std::size_t                         live_       = 0;
+    bool                                root_waits_ = false;
+    std::exception_ptr                  error_;
+    std::size_t*                        depth_;     // stats.depth of the runtime
+    int                                 epfd_       = -1;
+    std::size_t                         armed_      = 0;
+    std::size_t                         switches_   = 0;
+    std::size_t                         stack_size_;
+};
+
+inline channel_t::~channel_t()
+{
+    if(auto sched = owner.lock())
+    {
+        sched->disarm(*this);
+    }
+    if(fd >= 0) {::close(fd);}
+}
+
+inline scheduler_t& scheduler_of(env_t& env)
+{
+    if(not env.rt)
+    {
+        env.rt = std::make_shared<runtime_t>();
+    }
+    if(not env.rt->scheduler)
+    {
+        env.rt->scheduler = std::make_shared<scheduler_t>(
+                std::addressof(env.rt->stats.depth));
+    }
+    return *env.rt->scheduler;
+}
+
+} // sml
+#endif // SMALLISP_SCHEDULER_HPP